@@ -1,9 +1,5 @@
 #include <cryptlotto.hpp>
 
-const float TREE_PERCENT = 0.05;
-const float FEE_PERCENT = 0.10;
-const float REFERRAL_PERCENT = 0.05;
-
 namespace alaio {
 
     void cryptlotto::creategame( 
@@ -16,11 +12,14 @@ namespace alaio {
                 const uint64_t& winners, 
                 const time_point_sec& ends, 
                 const asset& price,
-                const vector<double>& percentages) {
+                const vector<uint16_t>& percentages) {
         require_auth( get_self() );
         games_index games(get_self(), get_self().value);
         auto found_game = games.find(id.value);
         check(found_game == games.end(), "Game with id exists");
+        check(id != "deposit"_n, "deposit is a reserved memo");
+        results_index results(get_self(), get_self().value);
+        check(results.find(id.value) == results.end(), "Game with id has already been played");
             auto sym = price.symbol;
             asset_valid(price);
             check( price.amount > 0, "price must be greater than 0" );
@@ -28,6 +27,14 @@ namespace alaio {
             auto _now = time_point_sec(current_time_point());
             check(ends > _now, "ending cant be before now");
 
+            // prize split in basis points, one entry per winner
+            check(percentages.size() == winners, "need one payout percentage per winner");
+            uint64_t total_bps = 0;
+            for(auto it = percentages.begin(); it != percentages.end(); it++) {
+                total_bps += *it;
+            }
+            check(total_bps <= BPS_DENOMINATOR, "payout percentages exceed 100%");
+
             asset winnings;
             winnings.amount = 0;
             winnings.symbol = sym;
@@ -41,18 +48,19 @@ namespace alaio {
                 row.reserved = reserved;
                 row.ticket_limit = ticket_limit;
                 row.winners = winners;
+                row.sold = 0;
+                row.revealed = 0;
+                row.players = 0;
+                row.seed = checksum256();
+                row.tree_index = 0;
+                row.tree_members = 0;
+                row.leaves = 0;
+                row.status = GAME_OPEN;
                 row.price = price;
                 row.ends = ends;
                 row.winnings = winnings;
+                row.percentages = percentages;
             });
-
-            winner_percentage percentage_index(get_self(), id.value);
-            for(auto it = percentages.begin(); it != percentages.end(); it++) {
-                percentage_index.emplace(get_self(), [&](auto& row) {
-                    row.id = percentage_index.available_primary_key();
-                    row.percent = *it;
-                });
-            }
         
     }
 
@@ -65,17 +73,55 @@ namespace alaio {
         });
     }
 
+    void cryptlotto::setfees( const name& game, const vector<uint16_t>& fees ) {
+        require_auth( get_self() );
+        games_index games(get_self(), get_self().value);
+        auto found_game = games.find(game.value);
+        check(found_game != games.end(), "Game does not exsist");
+        check(found_game->status == GAME_OPEN && found_game->sold == 0, "Game already has tickets sold");
+
+        // empty goes back to default_fees, otherwise fee, referral and tree in basis points
+        check(fees.empty() || fees.size() == 3, "need fee, referral and tree basis points");
+        uint64_t total_bps = 0;
+        for(auto it = fees.begin(); it != fees.end(); it++) {
+            total_bps += *it;
+        }
+        check(total_bps <= BPS_DENOMINATOR, "fees exceed 100%");
+
+        games.modify(found_game, get_self(), [&](auto& row) {
+            row.fees = fees;
+        });
+    }
+
     void cryptlotto::deletegame( const name& game ) {
         require_auth( get_self() );
         games_index games(get_self(), get_self().value);
         auto found_game = games.find(game.value);
         check(found_game != games.end(), "game does not exist");
-        cleanup(found_game->id);
-        games.erase(found_game);
-    }
+        check(found_game->status <= GAME_REVEALING, "game is already settling or refunding");
 
-    void cryptlotto::refund_tickets( const name& game ) {
+        // stop sales and reveals, settle then refunds every player in batches
+        games.modify(found_game, get_self(), [&](auto& row) {
+            row.status = GAME_REFUNDING;
+        });
+        print(game, " refunding, call settle to credit refunds\n");
+    }
 
+    bool cryptlotto::refund_tickets( const name& game, uint64_t& cursor, uint64_t& budget ) {
+        // participants already hold each user's total spend, so every player gets one credit, paid out by claim
+        participants_index participants(get_self(), game.value);
+        auto participant = participants.lower_bound(cursor);
+        while(participant != participants.end() && budget > 0) {
+            // referral and tree shares have left the game, only what it still holds goes back
+            asset refund = participant->spent - participant->shared;
+            if(refund.amount > 0) {
+                credit(participant->user, refund);
+            }
+            cursor = participant->user.value + 1;
+            participant++;
+            budget--;
+        }
+        return participant == participants.end();
     }
 
     void cryptlotto::submithash( const name& user, const name& game, const checksum256& hash ) {
@@ -94,78 +140,309 @@ namespace alaio {
         print("submitted hash");
     }
 
+    void cryptlotto::claimtree( const name& user, const name& game ) {
+        require_auth(user);
+        games_index games(get_self(), get_self().value);
+        auto found_game = games.find(game.value);
+        check(found_game != games.end(), "game does not exist");
+        check(found_game->status != GAME_REFUNDING, "game is being refunded");
+
+        referrals_index referrals(get_self(), game.value);
+        auto referral = referrals.find(user.value);
+        check(referral != referrals.end(), "user is not in the referral tree");
+
+        asset tree_reward = tree_owed(*referral, found_game->tree_index, found_game->price.symbol);
+        check(tree_reward.amount > 0, "no tree rewards to claim");
+        // keep the sub unit remainder accruing instead of snapping to the index
+        referrals.modify(referral, get_self(), [&](auto& row) {
+            row.tree_paid += uint128_t(tree_reward.amount) * TREE_INDEX_SCALE;
+        });
+        send_transfer(get_self(), user, tree_reward, "Tree Reward");
+    }
+
+    void cryptlotto::claim( const name& user ) {
+        require_auth(user);
+        balances_index balances(get_self(), user.value);
+        auto balance = balances.begin();
+        check(balance != balances.end(), "nothing to claim");
+        // one transfer per token the user has been credited in
+        while(balance != balances.end()) {
+            if(balance->balance.amount > 0) {
+                send_transfer(get_self(), user, balance->balance, "Cryptlotto Claim");
+            }
+            balance = balances.erase(balance);
+        }
+    }
+
     void cryptlotto::purchase( const name& user, const name& to, const asset& quantity, const string& memo ) {
         if (user == get_self() || to != get_self()){ return; }
-        string str = memo;
-        string game;
-        string referrer;
-        
-        std::size_t split = memo.find(" ");
-        if(split != string::npos) {
-            game = memo.substr(0, str.find(" "));
-            referrer = str.substr(split+1, str.length());
-        } else {
-            game = memo;
-            referrer = "";
-        }
-        
         print("quantity from alacrity, ", quantity, "\n");
-        // check if game exsists
+
+        // prepaid balance for buytickets, withdrawn again with claim
+        if(memo == "deposit") {
+            credit(user, quantity);
+            return;
+        }
+
+        purchase_memo parsed = parse_memo(memo);
+        games_index games(get_self(), get_self().value);
+        if(parsed.orders_count == 1 && parsed.orders[0].qty == 0) {
+            buy_tickets(games, user, quantity, parsed.orders[0].game, parsed);
+            return;
+        }
+
+        // split one transfer across several games, the games stay cached in this index for buy_tickets
+        int64_t total = 0;
+        std::array<asset, MAX_MEMO_GAMES> costs;
+        for(uint8_t i = 0; i < parsed.orders_count; i++) {
+            auto found_game = games.find(parsed.orders[i].game.value);
+            check(found_game != games.end(), "game does not exist");
+            check(found_game->price.symbol == quantity.symbol, "Wrong currency for game");
+            check(parsed.orders[i].qty <= uint64_t((asset::max_amount - total) / found_game->price.amount), "Cant Buy that many tickets");
+            costs[i] = found_game->price;
+            costs[i].amount *= parsed.orders[i].qty;
+            total += costs[i].amount;
+        }
+        check(total == quantity.amount, "Amount does not match the tickets in the memo");
+        for(uint8_t i = 0; i < parsed.orders_count; i++) {
+            buy_tickets(games, user, costs[i], parsed.orders[i].game, parsed);
+        }
+    }
+
+    void cryptlotto::buytickets( const name& user, const name& game, const uint64_t& qty, const checksum256& hash ) {
+        require_auth(user);
+        check(qty > 0, "must buy at least one ticket");
         games_index games(get_self(), get_self().value);
-        auto found_game = games.find(name(game).value);
+        auto found_game = games.find(game.value);
         check(found_game != games.end(), "game does not exist");
+        check(qty <= uint64_t(asset::max_amount / found_game->price.amount), "Cant Buy that many tickets");
 
-        tickets_index tickets(get_self(), name(game).value);
-        auto reserve = tickets.find(found_game->reserved - 1);
-        //print("last ticket", last_ticket->id);
+        asset cost = found_game->price;
+        cost.amount *= qty;
+        debit(user, cost);
+
+        purchase_memo order;
+        order.orders_count = 0;
+        order.has_hash = true;
+        order.hash = hash;
+        buy_tickets(games, user, cost, game, order);
+    }
+
+    void cryptlotto::buy_tickets( games_index& games, const name& user, const asset& quantity, const name& game, const purchase_memo& parsed ) {
+        const name& referrer = parsed.referrer;
+
+        // check if game exsists
+        auto found_game = games.find(game.value);
+        check(found_game != games.end(), "game does not exist");
+
+        uint64_t sold = found_game->sold;
 
         // check if game has ended
         auto now = time_point_sec(current_time_point()).utc_seconds;
-        check(found_game->ends.utc_seconds > now || reserve == tickets.end(), "Game has ended");
+        check(found_game->status == GAME_OPEN, "Game is not open");
+        check(found_game->ends.utc_seconds > now || sold < found_game->reserved, "Game has ended");
 
         // check for valid payment and if payment creates whole number for amount of tickets to buy
         check(quantity.symbol == found_game->price.symbol, "Wrong currency for game");
         check(quantity.amount % found_game->price.amount == 0, "Amount not divisable by game price" );
 
-        // check if user has submitted their secret
-        game_hashes hashes(get_self(), name(game).value);
-        auto secret_hash = hashes.find(user.value);
-        check(secret_hash != hashes.end(), "submit hash first");
+        // the commitment comes with the memo, or from an earlier submithash
+        game_hashes hashes(get_self(), game.value);
+        auto secret_hash = hashes.end();
+        checksum256 commitment_hash = parsed.hash;
+        if(!parsed.has_hash) {
+            secret_hash = hashes.find(user.value);
+            check(secret_hash != hashes.end(), "submit hash first");
+            commitment_hash = secret_hash->hash;
+        }
 
+        uint64_t ticket_qty = quantity.amount / found_game->price.amount;
         if(found_game->ticket_limit > 0){
-            tickets_index tickets(get_self(), name(game).value);
-            auto tickiter = tickets.find(found_game->ticket_limit - 1);
-            check(tickiter == tickets.end() , "Game is sold out");
-
-            tickiter = tickets.find(found_game->ticket_limit - ((quantity.amount / found_game->price.amount)));
-            check(tickiter == tickets.end() && found_game->ticket_limit >= (quantity.amount / found_game->price.amount) , "Cant Buy that many tickets");
+            check(sold < found_game->ticket_limit, "Game is sold out");
+            check(sold + ticket_qty <= found_game->ticket_limit, "Cant Buy that many tickets");
         }
 
         // update tree and pay out referrals
         print("Update Tree \n");
-        update_tree(name(game), quantity, user, name(referrer));
+        uint128_t tree_index = found_game->tree_index;
+        uint64_t tree_members = found_game->tree_members;
+        fee_split split = found_game->split(quantity.amount);
+        asset shared;
+        shared.amount = update_tree(game, quantity.symbol, split, user, referrer, tree_index, tree_members);
+        shared.symbol = quantity.symbol;
 
         // calculate asset to add to winnings
         asset after_fees;
-        after_fees.amount = quantity.amount - (quantity.amount * (REFERRAL_PERCENT + FEE_PERCENT + TREE_PERCENT));
+        after_fees.amount = split.pot;
         after_fees.symbol = quantity.symbol;
 
+        participants_index participants(get_self(), game.value);
+        auto participant = participants.find(user.value);
+        bool new_player = participant == participants.end();
+
         print("after fees, ", after_fees, "\n");
         games.modify(found_game, get_self(), [&](auto& row) {
             row.winnings += after_fees;
+            row.sold += ticket_qty;
+            merkle_append(row.frontier, row.leaves, purchase_leaf(sold, sold + ticket_qty - 1, user, commitment_hash));
+            row.leaves += 1;
+            row.tree_index = tree_index;
+            row.tree_members = tree_members;
+            if(new_player) {
+                row.players += 1;
+            }
+            if(row.ticket_limit > 0 && row.sold >= row.ticket_limit) {
+                row.status = GAME_CLOSED;
+            }
         });
 
-        // give player tickets
-        for(int i = 0; i < quantity.amount / found_game->price.amount; i++) {
-            tickets.emplace(get_self(), [&](auto& row) {
-                row.id = tickets.available_primary_key();
+        // tickets bought under the same hash share one commitment row
+        commitments_index commitments(get_self(), game.value);
+        auto commit_index = commitments.get_index<"bycommit"_n>();
+        auto found_commit = find_commitment(commit_index, user, commitment_hash);
+        uint64_t commitment_id = 0;
+        bool new_commitment = found_commit == commit_index.end();
+        if(!new_commitment) {
+            commitment_id = found_commit->id;
+            commit_index.modify(found_commit, get_self(), [&](auto& row) {
+                row.tickets += ticket_qty;
+            });
+        } else {
+            commitment_id = commitments.available_primary_key();
+            commitments.emplace(get_self(), [&](auto& row) {
+                row.id = commitment_id;
                 row.user = user;
-                row.hash = secret_hash->hash;
+                row.hash = commitment_hash;
+                row.tickets = ticket_qty;
             });
         }
 
+        if(new_player) {
+            participants.emplace(get_self(), [&](auto& row) {
+                row.user = user;
+                row.tickets = ticket_qty;
+                row.spent = quantity;
+                row.shared = shared;
+                row.commitments = 1;
+            });
+        } else {
+            participants.modify(participant, get_self(), [&](auto& row) {
+                row.tickets += ticket_qty;
+                row.spent += quantity;
+                row.shared += shared;
+                if(new_commitment) {
+                    row.commitments += 1;
+                }
+            });
+        }
+
+        // give player one ticket range for the whole purchase
+        tickets_index tickets(get_self(), game.value);
+        tickets.emplace(get_self(), [&](auto& row) {
+            row.first_id = sold;
+            row.last_id = sold + ticket_qty - 1;
+            row.user = user;
+            row.commitment = commitment_id;
+        });
+
         // delete hash from table
-        hashes.erase(secret_hash);
+        if(secret_hash != hashes.end()) {
+            hashes.erase(secret_hash);
+        }
+    }
+
+    cryptlotto::purchase_memo cryptlotto::parse_memo( std::string_view memo ) {
+        purchase_memo parsed;
+        parsed.orders_count = 1;
+        parsed.orders[0].qty = 0;
+        parsed.has_hash = false;
+        // text form: "<game>[ <referrer>][ <hash>]", a hash is told apart from a name by its length
+        std::size_t split = memo.find(' ');
+        std::string_view games = memo.substr(0, split);
+        if(games.find(':') == std::string_view::npos) {
+            parsed.orders[0].game = name(games);
+        } else {
+            // multi game form: "<game>:<qty>,<game>:<qty>..." in place of the game
+            parsed.orders_count = 0;
+            while(!games.empty()) {
+                check(parsed.orders_count < MAX_MEMO_GAMES, "too many games in memo");
+                std::size_t comma = games.find(',');
+                std::string_view order = games.substr(0, comma);
+                std::size_t colon = order.find(':');
+                check(colon != std::string_view::npos, "memo games must be game:qty");
+                parsed.orders[parsed.orders_count].game = name(order.substr(0, colon));
+                parsed.orders[parsed.orders_count].qty = parse_uint64(order.substr(colon + 1));
+                check(parsed.orders[parsed.orders_count].qty > 0, "must buy at least one ticket");
+                parsed.orders_count++;
+                games.remove_prefix(comma == std::string_view::npos ? games.size() : comma + 1);
+            }
+        }
+        while(split != std::string_view::npos) {
+            memo.remove_prefix(split + 1);
+            split = memo.find(' ');
+            std::string_view token = memo.substr(0, split);
+            if(token.size() == 64) {
+                parsed.hash = parse_hash_hex(token);
+                parsed.has_hash = true;
+            } else if(token.size() == 43 || token.size() == 44) {
+                // 32 bytes in base58, any other long token is a typo rather than a hash
+                parsed.hash = parse_hash_base58(token);
+                parsed.has_hash = true;
+            } else if(token.size() > 13) {
+                check(false, "memo token is neither a name nor a 64 hex or 43-44 base58 digit hash");
+            } else if(!token.empty()) {
+                parsed.referrer = name(token);
+            }
+        }
+        return parsed;
+    }
+
+    uint8_t cryptlotto::parse_hex_digit( const char& c ) {
+        if(c >= '0' && c <= '9') {
+            return c - '0';
+        } else if(c >= 'a' && c <= 'f') {
+            return c - 'a' + 10;
+        } else if(c >= 'A' && c <= 'F') {
+            return c - 'A' + 10;
+        }
+        check(false, "invalid hex digit in memo");
+        return 0;
+    }
+
+    uint64_t cryptlotto::parse_uint64( std::string_view digits ) {
+        check(!digits.empty() && digits.size() <= 19, "invalid ticket count in memo");
+        uint64_t value = 0;
+        for(char c : digits) {
+            check(c >= '0' && c <= '9', "invalid ticket count in memo");
+            value = value * 10 + (c - '0');
+        }
+        return value;
+    }
+
+    checksum256 cryptlotto::parse_hash_hex( std::string_view digits ) {
+        std::array<uint8_t, 32> bytes;
+        for(size_t i = 0; i < bytes.size(); i++) {
+            bytes[i] = (parse_hex_digit(digits[2 * i]) << 4) | parse_hex_digit(digits[2 * i + 1]);
+        }
+        return checksum256(bytes);
+    }
+
+    checksum256 cryptlotto::parse_hash_base58( std::string_view digits ) {
+        static const char alphabet[] = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+        std::array<uint8_t, 32> bytes = {};
+        // big endian base conversion, bytes *= 58 then += digit
+        for(char c : digits) {
+            const char* found = std::find(alphabet, alphabet + 58, c);
+            check(found != alphabet + 58, "invalid base58 digit in memo");
+            uint32_t carry = found - alphabet;
+            for(size_t i = bytes.size(); i > 0; i--) {
+                carry += uint32_t(bytes[i - 1]) * 58;
+                bytes[i - 1] = carry & 0xff;
+                carry >>= 8;
+            }
+            check(carry == 0, "base58 hash is longer than 32 bytes");
+        }
+        return checksum256(bytes);
     }
 
     void cryptlotto::submitsecret(const name& user, const name& game, const string& secret) {
@@ -174,193 +451,500 @@ namespace alaio {
         auto now = time_point_sec(current_time_point()).utc_seconds;
         games_index games(get_self(), get_self().value);
         auto found_game = games.find(game.value);
+        check(found_game != games.end(), "game does not exist");
         check(found_game->ends.utc_seconds < now, "Game has not ended yet");
+        // the seed is frozen once settlement starts
+        check(found_game->status <= GAME_REVEALING, "Game is no longer accepting secrets");
         
-        tickets_index tickets(get_self(), game.value);
-        auto reserve = tickets.find(found_game->reserved - 1);
-        check(reserve != tickets.end(), "Game Reserve not Met");
+        check(found_game->sold >= found_game->reserved, "Game Reserve not Met");
 
-        auto user_index = tickets.get_index<"byuser"_n>();
-        auto user_tickets = user_index.find(user.value);
-        check(user_tickets != user_index.end(), "no tickets for user");
+        participants_index participants(get_self(), game.value);
+        check(participants.find(user.value) != participants.end(), "no tickets for user");
 
+        // the secret is stored once on the user's commitment, not on each ticket
         checksum256 submitted_secret = sha256( (char *)secret.c_str(), secret.size() );
-        bool found_match = false;
-        for(auto i = user_index.begin(); i != user_index.end(); i++) {
-            if(i->hash == submitted_secret) {
-                user_index.modify(i, get_self(), [&](auto& row) {
-                    row.secret = secret;
-                });
-                found_match = true;
-            }
+        commitments_index commitments(get_self(), game.value);
+        auto commit_index = commitments.get_index<"bycommit"_n>();
+        auto found_commit = find_commitment(commit_index, user, submitted_secret);
+        check(found_commit != commit_index.end(), "No matching commitment found for this secret");
+
+        uint64_t newly_revealed = 0;
+        if(found_commit->secret.size() == 0) {
+            newly_revealed = found_commit->tickets;
+            commit_index.modify(found_commit, get_self(), [&](auto& row) {
+                row.secret = secret;
+            });
+        }
+
+        // only first reveals feed the entropy, resubmitting a secret cannot reroll it
+        if(newly_revealed > 0) {
+            games.modify(found_game, get_self(), [&](auto& row) {
+                row.revealed += newly_revealed;
+                row.seed = mix_seed(row.seed, secret);
+                row.status = GAME_REVEALING;
+            });
         }
-        check(found_match, "No matching commitment found for this secret");
     }
 
-    void cryptlotto::emptytables() {
+    void cryptlotto::emptytables( const uint64_t& max_rows ) {
         require_auth( get_self() );
-        games_index games(get_self(), get_first_receiver().value);
+        check(max_rows > 0, "max_rows must be greater than 0");
+        games_index games(get_self(), get_self().value);
+        settlements_index settlements(get_self(), get_self().value);
+        results_index results(get_self(), get_self().value);
+        uint64_t budget = max_rows;
         auto gameitr = games.begin();
-        // loop through all games
-        while(gameitr != games.end()) {
+        // loop through all games, a game row goes only once its tables are empty
+        while(gameitr != games.end() && budget > 0) {
+            if(!purge_game(gameitr->id, budget)) {
+                break;
+            }
+            auto cursor = settlements.find(gameitr->id.value);
+            if(cursor != settlements.end()) {
+                settlements.erase(cursor);
+            }
+            // a results row retires the id, so creategame cannot reuse it
+            if(results.find(gameitr->id.value) == results.end()) {
+                results.emplace(get_self(), [&](auto& row) {
+                    row.game = gameitr->id;
+                    row.seed = gameitr->seed;
+                    row.tickets = gameitr->sold;
+                    row.root = merkle_root(gameitr->frontier, gameitr->leaves);
+                });
+            }
             gameitr = games.erase(gameitr);
-
-            cleanup(gameitr->id);
         }
-    }
 
-    void cryptlotto::cleanup(const name& game) {
-        tickets_index tickets(get_self(), game.value);
-        auto tickiter = tickets.begin();
-        while(tickiter != tickets.end()) {
-            tickiter = tickets.erase(tickiter);
-        }
-
-        game_hashes hashes(get_self(), game.value);
-        auto hashiter = hashes.begin();
-        while(hashiter != hashes.end()) {
-            hashiter = hashes.erase(hashiter);
+        if(gameitr == games.end()) {
+            print("tables empty\n");
+        } else {
+            print("rows remaining, call emptytables again\n");
         }
+    }
 
-        winner_percentage perc(get_self(), game.value);
-        auto piter = perc.begin();
-        while(piter != perc.end()) {
-            piter = perc.erase(piter);
+    void cryptlotto::cleanup( const name& game, const uint64_t& max_rows ) {
+        require_auth( get_self() );
+        check(max_rows > 0, "max_rows must be greater than 0");
+        // a game still in the table owns its rows, settle frees them after crediting the tree
+        games_index games(get_self(), get_self().value);
+        check(games.find(game.value) == games.end(), "game still exists, call settle");
+        uint64_t budget = max_rows;
+        if(purge_game(game, budget)) {
+            print(game, " cleaned up\n");
+        } else {
+            print(game, " rows remaining, call cleanup again\n");
         }
     }
 
-    void cryptlotto::getendgames( ) {
+    void cryptlotto::getendgames( const uint64_t& max_games, const uint64_t& max_rows ) {
         require_auth( get_self() );
         auto now = time_point_sec(current_time_point()).utc_seconds;
         games_index games(get_self(), get_self().value);
-        auto gameitr = games.begin();
-
-        
+        auto status_index = games.get_index<"bystatus"_n>();
+        uint64_t budget = max_rows;
+        uint64_t visited = 0;
 
-        while(gameitr != games.end()) {
-
-            if(gameitr->ends.utc_seconds < now) {
-                revealwinner(gameitr->id);
-                gameitr = games.erase(gameitr);
-            } else {
+        // finish refunds and games already in settlement first, a game moved forward is never visited twice
+        for(int status = GAME_REFUNDING; status >= GAME_OPEN; status--) {
+            // each status is ordered by due time, stop at the first one not due yet, deleted games refund right away
+            auto gameitr = status_index.lower_bound(uint128_t(status) << 64);
+            while(gameitr != status_index.end() && gameitr->status == status && (gameitr->get_due() < now || status == GAME_REFUNDING)) {
+                if(visited >= max_games || budget == 0) {
+                    return;
+                }
+                // step past the game first, settling it may erase its row
+                name game = gameitr->id;
                 gameitr++;
+                settle_game(game, budget);
+                visited++;
             }
         }
     }
 
+    void cryptlotto::getroot( const name& game ) {
+        // settled games keep their root in the results table
+        games_index games(get_self(), get_self().value);
+        auto found_game = games.find(game.value);
+        if(found_game != games.end()) {
+            print("root ", merkle_root(found_game->frontier, found_game->leaves), " leaves ", found_game->leaves, "\n");
+            return;
+        }
+        results_index results(get_self(), get_self().value);
+        auto found_result = results.find(game.value);
+        check(found_result != results.end(), "game does not exist");
+        print("root ", found_result->root, "\n");
+    }
+
     void cryptlotto::revealwinner( const name& game ) {
         require_auth( get_self() );
+        uint64_t budget = UINT64_MAX;
+        settle_game(game, budget);
+    }
+
+    void cryptlotto::settle( const name& game, const uint64_t& max_rows ) {
+        require_auth( get_self() );
+        check(max_rows > 0, "max_rows must be greater than 0");
+        uint64_t budget = max_rows;
+        if(settle_game(game, budget)) {
+            print(game, " settled\n");
+        } else {
+            print(game, " settlement paused, call settle again\n");
+        }
+    }
+
+    bool cryptlotto::settle_game( const name& game, uint64_t& budget ) {
         games_index games(get_self(), get_self().value);
         auto found_game = games.find(game.value);
         check(found_game != games.end(), "game does not exist");
 
-        print("reveal ", game, "\n");
+        settlements_index settlements(get_self(), get_self().value);
+        auto cursor = settlements.find(game.value);
+        if(cursor == settlements.end()) {
+            cursor = settlements.emplace(get_self(), [&](auto& row) {
+                row.game = game;
+                row.phase = SETTLE_TALLY;
+                row.cursor = 0;
+            });
+        }
+        uint8_t phase = cursor->phase;
+        uint64_t position = cursor->cursor;
+
+        print("settle ", game, " phase ", uint64_t(phase), " at ", position, "\n");
 
         tickets_index tickets(get_self(), game.value);
-        uint64_t ticket_count = 0;
-        if(tickets.begin() != tickets.end()) {
-            uint32_t result_value = 0;
-            for(auto i = tickets.begin(); i != tickets.end(); i++) {
-                ticket_count++;
-                if(i->secret.size() > 0) {
-                    player_ticket ticket = { i->id, i->user, i->secret, i->hash };
-                    checksum256 result = sha256( (char *)&ticket, sizeof(ticket) );
-                    auto hash_result = result.extract_as_byte_array();
-                    result_value += hash_result[0];
+        winners_index winners(get_self(), game.value);
+
+        while(budget > 0 && phase != SETTLE_DONE) {
+            if(phase == SETTLE_TALLY && found_game->status == GAME_REFUNDING) {
+                // deleted by the contract owner
+                phase = SETTLE_REFUND;
+                position = 0;
+            } else if(phase == SETTLE_TALLY) {
+                auto now = time_point_sec(current_time_point()).utc_seconds;
+                check(found_game->ends.utc_seconds < now, "Game has not ended yet");
+                print("Ticket Count: ", found_game->sold, "\n");
+                if(found_game->sold > 0 && found_game->sold < found_game->reserved) {
+                    print("Game Reserve not Met, refunding\n");
+                    games.modify(found_game, get_self(), [&](auto& row) {
+                        row.status = GAME_REFUNDING;
+                    });
+                    phase = SETTLE_REFUND;
+                    position = 0;
+                } else if(found_game->sold > 0 && found_game->revealed == 0 && now < found_game->ends.utc_seconds + REVEAL_WINDOW) {
+                    // park the game under its reveal deadline so it stops holding up the games ending after it
+                    print("No commitment reveals yet, waiting\n");
+                    games.modify(found_game, get_self(), [&](auto& row) {
+                        row.status = GAME_WAITING;
+                    });
+                    budget--;
+                    break;
+                } else if(found_game->sold > 0 && found_game->revealed == 0) {
+                    print("No commitment reveals, refunding\n");
+                    games.modify(found_game, get_self(), [&](auto& row) {
+                        row.status = GAME_REFUNDING;
+                    });
+                    phase = SETTLE_REFUND;
+                    position = 0;
+                } else if(found_game->sold > 0) {
+                    // bind the draw to the exact ticket set through the purchase root
+                    games.modify(found_game, get_self(), [&](auto& row) {
+                        row.seed = hash_pair(row.seed, merkle_root(row.frontier, row.leaves));
+                        row.status = GAME_SETTLING;
+                    });
+                    phase = SETTLE_PICK;
+                } else {
+                    print("No tickets sold wah wah wah");
+                    games.modify(found_game, get_self(), [&](auto& row) {
+                        row.status = GAME_SETTLING;
+                    });
+                    phase = SETTLE_ARCHIVE;
                 }
-            }
-            print("Ticket Count: ", ticket_count, "\n");
-            check(result_value > 0, "No commitment reveals, uh oh \n");
-            winner_percentage perc(get_self(), game.value);
-            auto piter = perc.begin();
-            print("result", result_value, "\n");
-            for(uint64_t winnerint = 0; winnerint < found_game->winners; winnerint ++) {
-                asset winnings = found_game->winnings;
-                winnings.amount = winnings.amount * piter->percent;
-                winner result_ticket = { result_value, winnerint };
-                checksum256 result = sha256( (char *)&result_ticket, sizeof(result_ticket) );
-                auto hash_result = result.extract_as_byte_array();
-                uint64_t ticket = hash_result[0];
-                auto winning_ticket = tickets.find(ticket % ticket_count);
-                print("Val: ", ticket, ", Winning Ticket: ", ticket % ticket_count,  ", Winner: ", winning_ticket->user, "\n");
-                send_transfer(get_self(), winning_ticket->user, winnings, game.to_string() + " Winner of Lotto");
-                piter++;
+                position = 0;
+                budget--;
+            } else if(phase == SETTLE_PICK) {
+                // position is the prize rank being drawn, a ticket can win at most once
+                if(position < found_game->winners && position < found_game->sold) {
+                    check(position < found_game->percentages.size(), "missing payout percentage");
+                    asset winnings = found_game->winnings;
+                    winnings.amount = int64_t(int128_t(winnings.amount) * found_game->percentages[position] / BPS_DENOMINATOR);
 
+                    uint64_t ticket = pick_distinct(game, found_game->seed, position, found_game->sold);
+                    // ranges are contiguous, so the first range ending at or after the ticket holds it
+                    auto winning_ticket = tickets.lower_bound(ticket);
+                    print("Winning Ticket: ", ticket,  ", Winner: ", winning_ticket->user, "\n");
+                    winners.emplace(get_self(), [&](auto& row) {
+                        row.rank = position;
+                        row.ticket = ticket;
+                        row.user = winning_ticket->user;
+                        row.amount = winnings;
+                    });
+                    position++;
+                    budget--;
+                } else {
+                    phase = SETTLE_PAY;
+                    position = 0;
+                }
+            } else if(phase == SETTLE_PAY) {
+                // add up this batch per recipient so a user holding several winning tickets is credited once
+                std::map<name, asset> payouts;
+                auto prize = winners.find(position);
+                while(prize != winners.end() && budget > 0) {
+                    auto payout = payouts.find(prize->user);
+                    if(payout != payouts.end()) {
+                        payout->second += prize->amount;
+                    } else {
+                        payouts.emplace(prize->user, prize->amount);
+                    }
+                    prize++;
+                    position++;
+                    budget--;
+                }
+                for(auto payout = payouts.begin(); payout != payouts.end(); payout++) {
+                    credit(payout->first, payout->second);
+                }
+                if(prize == winners.end()) {
+                    phase = SETTLE_ARCHIVE;
+                    position = 0;
+                }
+            } else if(phase == SETTLE_REFUND) {
+                // position is the next participant to refund
+                if(refund_tickets(game, position, budget)) {
+                    phase = SETTLE_CLEANUP;
+                    position = 0;
+                }
+            } else if(phase == SETTLE_ARCHIVE) {
+                // keep winners, payouts and a verifiable record of the ticket set once the rows are gone
+                results_index results(get_self(), get_self().value);
+                auto result = results.find(game.value);
+                if(result == results.end()) {
+                    results.emplace(get_self(), [&](auto& row) {
+                        row.game = game;
+                        row.seed = found_game->seed;
+                        row.tickets = found_game->sold;
+                        row.root = merkle_root(found_game->frontier, found_game->leaves);
+                    });
+                    budget--;
+                    continue;
+                }
+                // position is the next prize rank to copy, one row of budget per winner
+                auto prize = winners.find(position);
+                if(prize != winners.end()) {
+                    results.modify(result, get_self(), [&](auto& row) {
+                        while(prize != winners.end() && budget > 0) {
+                            row.winners.push_back(prize->user);
+                            row.payouts.push_back(prize->amount);
+                            prize++;
+                            position++;
+                            budget--;
+                        }
+                    });
+                }
+                if(prize == winners.end()) {
+                    games.modify(found_game, get_self(), [&](auto& row) {
+                        row.status = GAME_SETTLED;
+                    });
+                    phase = SETTLE_CLEANUP;
+                    position = 0;
+                }
+            } else if(phase == SETTLE_CLEANUP) {
+                // refunds keep the tree shares back, so unclaimed ones are credited either way
+                if(flush_tree(game, found_game->tree_index, found_game->price.symbol, budget) && purge_game(game, budget)) {
+                    phase = SETTLE_DONE;
+                }
             }
-            
-            // cleanup(game);
-        } else {
-            print("No tickets sold wah wah wah");
         }
+
+        if(phase == SETTLE_DONE) {
+            settlements.erase(cursor);
+            games.erase(found_game);
+            return true;
+        }
+
+        settlements.modify(cursor, get_self(), [&](auto& row) {
+            row.phase = phase;
+            row.cursor = position;
+        });
+        return false;
     }
 
-    void cryptlotto::update_tree( const name& game, const asset& total, const name& user, const name& referrer) {
-        // tickets table
+    bool cryptlotto::purge_game( const name& game, uint64_t& budget ) {
+        // rows are always erased from the front, so each table's head is where the next call resumes
         tickets_index tickets(get_self(), game.value);
-        auto users_index = tickets.get_index<"byuser"_n>();
-        auto found_user = users_index.find(referrer.value);
+        auto tickiter = tickets.begin();
+        while(tickiter != tickets.end() && budget > 0) {
+            tickiter = tickets.erase(tickiter);
+            budget--;
+        }
+
+        game_hashes hashes(get_self(), game.value);
+        auto hashiter = hashes.begin();
+        while(hashiter != hashes.end() && budget > 0) {
+            hashiter = hashes.erase(hashiter);
+            budget--;
+        }
+
+        winners_index winners(get_self(), game.value);
+        auto winiter = winners.begin();
+        while(winiter != winners.end() && budget > 0) {
+            winiter = winners.erase(winiter);
+            budget--;
+        }
+
+        swaps_index swaps(get_self(), game.value);
+        auto swapiter = swaps.begin();
+        while(swapiter != swaps.end() && budget > 0) {
+            swapiter = swaps.erase(swapiter);
+            budget--;
+        }
+
+        commitments_index commitments(get_self(), game.value);
+        auto commititer = commitments.begin();
+        while(commititer != commitments.end() && budget > 0) {
+            commititer = commitments.erase(commititer);
+            budget--;
+        }
+
+        participants_index participants(get_self(), game.value);
+        auto partiter = participants.begin();
+        while(partiter != participants.end() && budget > 0) {
+            partiter = participants.erase(partiter);
+            budget--;
+        }
+
+        // settlement flushes the tree first, these only remain for games wiped by emptytables
+        referrals_index referrals(get_self(), game.value);
+        auto refiter = referrals.begin();
+        while(refiter != referrals.end() && budget > 0) {
+            refiter = referrals.erase(refiter);
+            budget--;
+        }
+
+        referrers_index referrers(get_self(), game.value);
+        auto pairiter = referrers.begin();
+        while(pairiter != referrers.end() && budget > 0) {
+            pairiter = referrers.erase(pairiter);
+            budget--;
+        }
 
-        if(found_user != users_index.end() && user != referrer) {
+        return tickiter == tickets.end() && hashiter == hashes.end() && winiter == winners.end() && swapiter == swaps.end() && commititer == commitments.end() && partiter == participants.end()
+            && refiter == referrals.end() && pairiter == referrers.end();
+    }
+
+    bool cryptlotto::flush_tree( const name& game, const uint128_t& tree_index, const symbol& sym, uint64_t& budget ) {
+        // credit members what they have not claimed yet, then drop the tree rows
+        referrals_index referrals(get_self(), game.value);
+        auto referral = referrals.begin();
+        while(referral != referrals.end() && budget > 0) {
+            asset tree_reward = tree_owed(*referral, tree_index, sym);
+            if(tree_reward.amount > 0) {
+                credit(referral->user, tree_reward);
+            }
+            referral = referrals.erase(referral);
+            budget--;
+        }
+
+        referrers_index referrers(get_self(), game.value);
+        auto referrer = referrers.begin();
+        while(referrer != referrers.end() && budget > 0) {
+            referrer = referrers.erase(referrer);
+            budget--;
+        }
+
+        return referral == referrals.end() && referrer == referrers.end();
+    }
+
+    asset cryptlotto::tree_owed( const referral& member, const uint128_t& tree_index, const symbol& sym ) {
+        asset owed;
+        owed.amount = 0;
+        if(tree_index > member.tree_paid) {
+            owed.amount = int64_t((tree_index - member.tree_paid) / TREE_INDEX_SCALE);
+        }
+        owed.symbol = sym;
+        return owed;
+    }
+
+    uint64_t cryptlotto::pick_distinct( const name& game, const checksum256& seed, const uint64_t& rank, const uint64_t& ticket_count ) {
+        // partial fisher-yates over the virtual array [0, ticket_count), only displaced slots are stored
+        swaps_index swaps(get_self(), game.value);
+        uint64_t slot = rank + draw_ticket(seed, rank, ticket_count - rank);
+
+        auto at_slot = swaps.find(slot);
+        uint64_t ticket = at_slot != swaps.end() ? at_slot->ticket : slot;
+        auto at_rank = swaps.find(rank);
+        uint64_t head = at_rank != swaps.end() ? at_rank->ticket : rank;
+
+        // move the head of the unpicked range into the picked slot, later draws never read slot rank again
+        if(slot != rank) {
+            if(at_slot != swaps.end()) {
+                swaps.modify(at_slot, get_self(), [&](auto& row) {
+                    row.ticket = head;
+                });
+            } else {
+                swaps.emplace(get_self(), [&](auto& row) {
+                    row.slot = slot;
+                    row.ticket = head;
+                });
+            }
+        }
+        if(at_rank != swaps.end()) {
+            swaps.erase(at_rank);
+        }
+        return ticket;
+    }
+
+    int64_t cryptlotto::update_tree( const name& game, const symbol& sym, const fee_split& split, const name& user, const name& referrer, uint128_t& tree_index, uint64_t& tree_members ) {
+        // referrer must have played this game, returns the part of the purchase paid out to the tree
+        int64_t shared = 0;
+        participants_index participants(get_self(), game.value);
+        auto found_user = participants.find(referrer.value);
+
+        if(found_user != participants.end() && user != referrer) {
             print("referral ", referrer, " found in tickets \n");
             bool valid_referral = true;
 
             referrers_index referrers(get_self(), game.value);
+            auto pair_index = referrers.get_index<"bypair"_n>();
 
-            auto refer_user_index = referrers.get_index<"byuser"_n>();
-            auto referrer_referrers = refer_user_index.find(user.value);
-            auto referrer_index = referrers.get_index<"byreferrer"_n>();
-            auto referrer_refer = referrer_index.find(referrer.value);
-
-            if(referrer_refer != referrer_index.end()) {
+            if(pair_index.find(referral_pair(user, referrer)) != pair_index.end()) {
                 print(user, " has been referred by ", referrer, "\n");
                 valid_referral = false;
             } else {
                 print(user, " has not been referred by ", referrer, "\n");
             }
 
-            auto user_refer_index = referrers.get_index<"byuser"_n>();
-            auto user_referrers = user_refer_index.find(referrer.value);
-            auto user_index = referrers.get_index<"byreferrer"_n>();
-            auto user_refer = user_index.find(user.value);
-            
-            if(user_refer != user_index.end()) {
+            if(pair_index.find(referral_pair(referrer, user)) != pair_index.end()) {
                 print(referrer, " has referred by ", user, "\n");
                 valid_referral = false;
             } else {
                 print(referrer, " has not referred by ", user, "\n");
-                
             }
 
-            asset referral_reward;
-            referral_reward.amount = total.amount * REFERRAL_PERCENT;
-            referral_reward.symbol = total.symbol;
-            send_transfer(get_self(), name(referrer), referral_reward, "Referral Reward");
+            // a zero share would only leave an empty balances row behind
+            if(split.referral > 0) {
+                asset referral_reward;
+                referral_reward.amount = split.referral;
+                referral_reward.symbol = sym;
+                credit(referrer, referral_reward);
+                shared += split.referral;
+            }
 
             // user found in tickets increment or add user to referrals 
             referrals_index referrals(get_self(), game.value);
-            auto referral = referrals.find(found_user->user.value);
             
             if(valid_referral) {
-                auto tree_index = referrals.get_index<"bytree"_n>();
-                print("Last TreePos,  ", tree_index.end()->treepos, "\n");
-                print("First TreePos, ", tree_index.begin()->treepos, "\n");
+                auto referral = referrals.find(referrer.value);
                 if(referral != referrals.end()) {
-                    uint64_t treepos = 0;
-                    if(referral->treepos == 0) {
-                        treepos = tree_index.begin()->treepos + 1;
-                    } else {
-                        treepos = referral->treepos;
-                    }
                     referrals.modify(referral, get_self(), [&](auto& row) {
-                        row.treepos = tree_index.begin()->treepos + 1;
                         row.referrals += 1;
                     });
                 } else {
+                    // new members start at the current index, earlier rewards belong to earlier members
                     referrals.emplace(get_self(), [&](auto& row) {
                         row.user = referrer;
-                        row.treepos = 0;
                         row.referrals = 1;
+                        row.tree_paid = tree_index;
                     });
+                    tree_members++;
                 }
                 referrers.emplace(get_self(), [&](auto& row) {
                     row.id = referrers.available_primary_key();
@@ -369,35 +953,104 @@ namespace alaio {
                 });
             }
 
-            referral = referrals.find(found_user->user.value);
-            auto referral_index = referrals.get_index<"bytree"_n>();
-            auto applicable_referrals = referral_index.upper_bound(referral->treepos);
-
-            if(applicable_referrals != referral_index.end()) {
-                
-                uint64_t applicable_players = 0;
-                while(applicable_referrals != referral_index.end()) {
-                    applicable_referrals++;
-                    applicable_players++;
-                }
-                print(applicable_players, " players in tree \n");
-                asset tree_reward;
-                tree_reward.amount = total.amount * TREE_PERCENT / applicable_players;
-                tree_reward.symbol = total.symbol;
-
-                applicable_referrals = referral_index.upper_bound(referral->treepos);
-                for(auto referral = applicable_referrals; referral != referral_index.end(); referral ++) {
-                    print("send tree ", tree_reward, " to ", referral->user);
-                    send_transfer(get_self(), referral->user, tree_reward, "Tree Reward");
-                }
+            // every tree member accrues an equal share of the index, paid out by claimtree
+            if(tree_members > 0) {
+                print(tree_members, " players in tree \n");
+                tree_index += uint128_t(split.tree) * TREE_INDEX_SCALE / tree_members;
+                shared += split.tree;
             } else {
                 print("no applicable referrals \n");
             }
         } else {
             print(referrer, " not found in tickets \n");
         }
+        return shared;
+    }
 
-        
+    template<typename Index>
+    typename Index::const_iterator cryptlotto::find_commitment( Index& commit_index, const name& user, const checksum256& hash ) {
+        // the index key only carries a hash prefix, compare the full hash to skip collisions
+        uint128_t key = commitment_key(user, hash);
+        for(auto found = commit_index.lower_bound(key); found != commit_index.end() && found->get_commitment() == key; found++) {
+            if(found->hash == hash) {
+                return found;
+            }
+        }
+        return commit_index.end();
+    }
+
+    checksum256 cryptlotto::purchase_leaf( const uint64_t& first_id, const uint64_t& last_id, const name& user, const checksum256& hash ) {
+        auto data = pack(std::make_tuple(first_id, last_id, user, hash));
+        return sha256( data.data(), data.size() );
+    }
+
+    checksum256 cryptlotto::hash_pair( const checksum256& left, const checksum256& right ) {
+        auto data = pack(std::make_tuple(left, right));
+        return sha256( data.data(), data.size() );
+    }
+
+    void cryptlotto::merkle_append( vector<checksum256>& frontier, const uint64_t& leaves, const checksum256& leaf ) {
+        // frontier[h] holds the pending left node at height h, at most one per set bit of the leaf count
+        checksum256 node = leaf;
+        uint64_t size = leaves + 1;
+        for(size_t height = 0; height < MERKLE_DEPTH; height++) {
+            if(size & 1) {
+                if(frontier.size() <= height) {
+                    frontier.resize(height + 1);
+                }
+                frontier[height] = node;
+                return;
+            }
+            node = hash_pair(frontier[height], node);
+            size >>= 1;
+        }
+        check(false, "merkle tree is full");
+    }
+
+    checksum256 cryptlotto::merkle_root( const vector<checksum256>& frontier, const uint64_t& leaves ) {
+        // fixed depth tree, missing leaves are zero hashes
+        checksum256 node;
+        checksum256 zero;
+        uint64_t size = leaves;
+        for(size_t height = 0; height < MERKLE_DEPTH; height++) {
+            if(size & 1) {
+                node = hash_pair(frontier[height], node);
+            } else {
+                node = hash_pair(node, zero);
+            }
+            zero = hash_pair(zero, zero);
+            size >>= 1;
+        }
+        return node;
+    }
+
+    checksum256 cryptlotto::mix_seed( const checksum256& seed, const string& secret ) {
+        auto seed_bytes = seed.extract_as_byte_array();
+        string buffer( (char *)seed_bytes.data(), seed_bytes.size() );
+        buffer += secret;
+        return sha256( buffer.data(), buffer.size() );
+    }
+
+    uint64_t cryptlotto::draw_ticket( const checksum256& seed, const uint64_t& draw, const uint64_t& ticket_count ) {
+        check(ticket_count > 0, "no tickets to draw from");
+        // values below 2^64 % ticket_count would make the modulo biased, reject them
+        uint64_t threshold = (0 - ticket_count) % ticket_count;
+        winner result_ticket = { seed.extract_as_byte_array(), draw, 0 };
+        while(true) {
+            checksum256 result = sha256( (char *)&result_ticket, sizeof(result_ticket) );
+            auto hash_result = result.extract_as_byte_array();
+            // each digest yields four 64 bit candidates before rehashing
+            for(size_t word = 0; word < hash_result.size(); word += 8) {
+                uint64_t value = 0;
+                for(size_t i = 0; i < 8; i++) {
+                    value = (value << 8) | hash_result[word + i];
+                }
+                if(value >= threshold) {
+                    return value % ticket_count;
+                }
+            }
+            result_ticket.round++;
+        }
     }
 
     void cryptlotto::asset_valid( const asset& amount ) {
@@ -408,6 +1061,33 @@ namespace alaio {
         check( existing != statstable.end(), "token with symbol does not exsist" );
     }
 
+    void cryptlotto::credit( const name& user, const asset& amount ) {
+        balances_index balances(get_self(), user.value);
+        auto balance = balances.find(amount.symbol.code().raw());
+        if(balance != balances.end()) {
+            balances.modify(balance, get_self(), [&](auto& row) {
+                row.balance += amount;
+            });
+        } else {
+            balances.emplace(get_self(), [&](auto& row) {
+                row.balance = amount;
+            });
+        }
+    }
+
+    void cryptlotto::debit( const name& user, const asset& amount ) {
+        balances_index balances(get_self(), user.value);
+        auto balance = balances.find(amount.symbol.code().raw());
+        check(balance != balances.end() && balance->balance.amount >= amount.amount, "insufficient deposit balance");
+        if(balance->balance.amount == amount.amount) {
+            balances.erase(balance);
+        } else {
+            balances.modify(balance, get_self(), [&](auto& row) {
+                row.balance -= amount;
+            });
+        }
+    }
+
     void cryptlotto::send_transfer( const name& from, const name& to, const asset& amount, const string& memo ) {
         action(
             permission_level(get_self(), "active"_n),
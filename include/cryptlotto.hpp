@@ -8,11 +8,78 @@
 #include <stdlib.h>
 #include <cstdlib>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <array>
 #include <tuple>
 
 const uint64_t FILEID_MULTIPPLIER = 0x100000000;
 
+// game lifecycle, stored in game::status
+const uint8_t GAME_OPEN = 0;
+const uint8_t GAME_CLOSED = 1;      /* sold out before the end time */
+const uint8_t GAME_WAITING = 2;     /* ended without reveals, refunded after REVEAL_WINDOW */
+const uint8_t GAME_REVEALING = 3;   /* ended, secrets are being revealed */
+const uint8_t GAME_SETTLING = 4;
+const uint8_t GAME_SETTLED = 5;     /* results archived, rows being freed */
+const uint8_t GAME_REFUNDING = 6;
+
+// seconds an ended game waits for its first reveal before it is refunded
+const uint64_t REVEAL_WINDOW = 7 * 24 * 60 * 60;
+
+// most games a single purchase memo can split a transfer across
+const size_t MAX_MEMO_GAMES = 8;
+
+// basis points in 100%
+const uint64_t BPS_DENOMINATOR = 10000;
+
+// a purchase split into house fee, referral reward, tree reward and the prize pot
+struct fee_split {
+    int64_t fee;
+    int64_t referral;
+    int64_t tree;
+    int64_t pot;
+};
+
+constexpr int64_t bps_share( const int64_t& amount, const uint64_t& bps ) {
+    return int64_t(int128_t(amount) * bps / BPS_DENOMINATOR);
+}
+
+constexpr fee_split split_fees( const int64_t& amount, const uint64_t& fee_bps, const uint64_t& referral_bps, const uint64_t& tree_bps ) {
+    fee_split split = { bps_share(amount, fee_bps), bps_share(amount, referral_bps), bps_share(amount, tree_bps), 0 };
+    split.pot = amount - split.fee - split.referral - split.tree;
+    return split;
+}
+
+// compiled fee schedule, used by every game without its own
+template<uint16_t FeeBps, uint16_t ReferralBps, uint16_t TreeBps>
+struct fee_policy {
+    static_assert(uint64_t(FeeBps) + ReferralBps + TreeBps <= BPS_DENOMINATOR, "fees exceed 100%");
+
+    static constexpr fee_split split( const int64_t& amount ) {
+        return split_fees(amount, FeeBps, ReferralBps, TreeBps);
+    }
+};
+
+typedef fee_policy<1000, 500, 500> default_fees;
+
+// fixed point scale of the per member tree reward index
+const uint128_t TREE_INDEX_SCALE = 1000000000000;
+
+// settlement phases, stored in the settlements cursor
+const uint8_t SETTLE_TALLY = 0;
+const uint8_t SETTLE_PICK = 1;
+const uint8_t SETTLE_PAY = 2;
+const uint8_t SETTLE_ARCHIVE = 3;
+const uint8_t SETTLE_CLEANUP = 4;
+const uint8_t SETTLE_REFUND = 5;
+const uint8_t SETTLE_DONE = 6;
+
+// height of the purchase merkle tree, enough for 2^32 purchases per game
+const size_t MERKLE_DEPTH = 32;
+
 namespace alaio {
     using std::string;
     using std::tuple;
@@ -37,11 +104,14 @@ namespace alaio {
                 const uint64_t& winners, 
                 const time_point_sec& ends, 
                 const asset& price,
-                const vector<double>& percentages );
+                const vector<uint16_t>& percentages );
 
             [[alaio::action]]
             void updatetime( const name& id, const time_point_sec& ends );
 
+            [[alaio::action]]
+            void setfees( const name& game, const vector<uint16_t>& fees );
+
             [[alaio::action]]
             void deletegame( const name& game );
 
@@ -50,31 +120,88 @@ namespace alaio {
 
             [[alaio::action]]
             void submithash( const name& user, const name& game, const checksum256& hash );
+
+            [[alaio::action]]
+            void claimtree( const name& user, const name& game );
+
+            [[alaio::action]]
+            void claim( const name& user );
             
             [[alaio::on_notify("alaio.token::transfer")]]
             void purchase( const name& user, const name& to, const asset& quantity, const string& memo );
 
             [[alaio::action]]
-            void getendgames( );
+            void buytickets( const name& user, const name& game, const uint64_t& qty, const checksum256& hash );
+
+            [[alaio::action]]
+            void getendgames( const uint64_t& max_games, const uint64_t& max_rows );
             
             [[alaio::action]]
-            void emptytables( );
+            void emptytables( const uint64_t& max_rows );
 
             [[alaio::action]]
-            void cleanup( const name& game );
+            void cleanup( const name& game, const uint64_t& max_rows );
+
+            [[alaio::action]]
+            void getroot( const name& game );
 
             [[alaio::action]]
             void revealwinner( const name& game );
 
+            [[alaio::action]]
+            void settle( const name& game, const uint64_t& max_rows );
+
         private:
 
-            void refund_tickets( const name& game );
+            // (user, first 8 bytes of the commitment) packed for the 128 bit secondary index
+            static uint128_t commitment_key( const name& user, const checksum256& hash ) {
+                auto bytes = hash.extract_as_byte_array();
+                uint64_t prefix = 0;
+                for(size_t i = 0; i < 8; i++) {
+                    prefix = (prefix << 8) | bytes[i];
+                }
+                return (uint128_t(user.value) << 64) | prefix;
+            }
+
+            // (user, referrer) packed so a referral pair is a single find
+            static uint128_t referral_pair( const name& user, const name& referrer ) {
+                return (uint128_t(user.value) << 64) | referrer.value;
+            }
+
+            bool settle_game( const name& game, uint64_t& budget );
+
+            bool purge_game( const name& game, uint64_t& budget );
+
+            bool refund_tickets( const name& game, uint64_t& cursor, uint64_t& budget );
             
             void send_transfer( const name& from, const name& to, const asset& amount, const string& memo );
 
+            void credit( const name& user, const asset& amount );
+
+            void debit( const name& user, const asset& amount );
+
             void asset_valid( const asset& amount );
 
-            void update_tree( const name& game, const asset& total, const name& user, const name& referrer );
+            template<typename Index>
+            typename Index::const_iterator find_commitment( Index& commit_index, const name& user, const checksum256& hash );
+
+            checksum256 purchase_leaf( const uint64_t& first_id, const uint64_t& last_id, const name& user, const checksum256& hash );
+
+            checksum256 hash_pair( const checksum256& left, const checksum256& right );
+
+            void merkle_append( vector<checksum256>& frontier, const uint64_t& leaves, const checksum256& leaf );
+
+            checksum256 merkle_root( const vector<checksum256>& frontier, const uint64_t& leaves );
+
+            checksum256 mix_seed( const checksum256& seed, const string& secret );
+
+            uint64_t draw_ticket( const checksum256& seed, const uint64_t& draw, const uint64_t& ticket_count );
+
+            uint64_t pick_distinct( const name& game, const checksum256& seed, const uint64_t& rank, const uint64_t& ticket_count );
+
+            int64_t update_tree( const name& game, const symbol& sym, const fee_split& split, const name& user, const name& referrer, uint128_t& tree_index, uint64_t& tree_members );
+
+            bool flush_tree( const name& game, const uint128_t& tree_index, const symbol& sym, uint64_t& budget );
 
             struct [[alaio::table("games")]] game {
                 name            id;           /* autoincrement */
@@ -86,31 +213,70 @@ namespace alaio {
                 uint64_t        ticket_limit;
                 uint64_t        winners;
 
+                uint64_t        sold;         /* tickets sold, next ticket id */
+                uint64_t        revealed;     /* tickets with a revealed secret */
+                uint64_t        players;      /* distinct buyers */
+                checksum256     seed;         /* running sha256 over revealed secrets */
+                uint128_t       tree_index;   /* tree reward per member, scaled by TREE_INDEX_SCALE */
+                uint64_t        tree_members;
+                vector<checksum256> frontier; /* incremental merkle frontier of the purchase ranges */
+                uint64_t        leaves;       /* purchase ranges in the tree */
+
                 time_point_sec  ends;
                 asset           price;
                 asset           winnings;
+                uint8_t         status;
+                vector<uint16_t> percentages; /* prize split per winner in basis points */
+                vector<uint16_t> fees;        /* fee, referral and tree basis points, empty for default_fees */
                 
                 uint64_t primary_key() const { return id.value; }
-                uint64_t get_ends() const { return ends.utc_seconds; }
+                fee_split split( const int64_t& amount ) const {
+                    if(fees.empty()) {
+                        return default_fees::split(amount);
+                    }
+                    return split_fees(amount, fees[0], fees[1], fees[2]);
+                }
+                // when getendgames should next look at the game, waiting games are due at their reveal deadline
+                uint64_t get_due() const { return status == GAME_WAITING ? ends.utc_seconds + REVEAL_WINDOW : ends.utc_seconds; }
+                uint128_t get_status() const { return (uint128_t(status) << 64) | get_due(); }
             };
 
             struct [[alaio::table("tickets")]] ticket {
+                uint64_t     first_id;
+                uint64_t     last_id;      /* one row per purchase covering [first_id, last_id] */
+                name         user;
+                uint64_t     commitment;   /* id in the commitments table */
+
+                uint64_t primary_key() const { return last_id; }
+            };
+
+            struct [[alaio::table("commitments")]] commitment {
                 uint64_t     id;
                 name         user;
-                string       secret;
                 checksum256  hash;
+                string       secret;
+                uint64_t     tickets;      /* tickets bought under this commitment */
 
                 uint64_t primary_key() const { return id; }
-                uint64_t get_user() const { return user.value; }
+                uint128_t get_commitment() const { return commitment_key(user, hash); }
+            };
+
+            struct [[alaio::table("participants")]] participant {
+                name      user;
+                uint64_t  tickets;
+                asset     spent;
+                asset     shared;       /* referral and tree shares of spent already paid out, kept on refund */
+                uint64_t  commitments;
+
+                uint64_t primary_key() const { return user.value; }
             };
 
             struct [[alaio::table("referrals")]] referral {
                 name      user;
-                uint64_t  treepos;
                 uint64_t  referrals;
+                uint128_t tree_paid;    /* tree_index already paid to this member */
 
                 uint64_t primary_key() const { return user.value; }
-                uint64_t get_treepos() const { return treepos; }
                 uint64_t get_referrals() const { return referrals; }
             };
 
@@ -120,8 +286,7 @@ namespace alaio {
                 name referrer;
 
                 uint64_t primary_key() const { return id; }
-                uint64_t get_user() const { return user.value; }
-                uint64_t get_referrer() const { return referrer.value; }
+                uint128_t get_pair() const { return referral_pair(user, referrer); }
             };
 
             struct [[alaio::table("hashes")]] hash {
@@ -131,11 +296,45 @@ namespace alaio {
                 uint64_t primary_key() const { return user.value; }
             };
 
-            struct [[alaio::table("winpercent")]] percentages {
-                uint64_t id;
-                double   percent;
+            struct [[alaio::table("settlements")]] settlement {
+                name      game;
+                uint8_t   phase;
+                uint64_t  cursor;       /* next prize rank in pick/pay/archive, next user in refund */
 
-                uint64_t primary_key() const { return id; }
+                uint64_t primary_key() const { return game.value; }
+            };
+
+            struct [[alaio::table("results")]] result {
+                name            game;
+                vector<name>    winners;
+                vector<asset>   payouts;
+                checksum256     seed;
+                uint64_t        tickets;
+                checksum256     root;   /* merkle root of the purchase ranges */
+
+                uint64_t primary_key() const { return game.value; }
+            };
+
+            struct [[alaio::table("winners")]] game_winner {
+                uint64_t  rank;
+                uint64_t  ticket;
+                name      user;
+                asset     amount;
+
+                uint64_t primary_key() const { return rank; }
+            };
+
+            struct [[alaio::table("swaps")]] ticket_swap {
+                uint64_t  slot;
+                uint64_t  ticket;
+
+                uint64_t primary_key() const { return slot; }
+            };
+
+            struct [[alaio::table("balances")]] user_balance {
+                asset    balance;       /* scoped by user */
+
+                uint64_t primary_key() const { return balance.symbol.code().raw(); }
             };
 
             struct [[alaio::table]] currency_stats {
@@ -146,31 +345,64 @@ namespace alaio {
                 uint64_t primary_key()const { return supply.symbol.code().raw(); }
             };
             
-            typedef struct player_ticket {
-                uint64_t ticket_id;
-                name user;
-                string secret;
+            typedef struct game_order {
+                name game;
+                uint64_t qty;           /* 0 spends the whole transfer on this game */
+            } game_order;
+
+            typedef struct purchase_memo {
+                std::array<game_order, MAX_MEMO_GAMES> orders;
+                uint8_t orders_count;
+                name referrer;
+                bool has_hash;
                 checksum256 hash;
-            } player_ticket;
+            } purchase_memo;
 
             typedef struct winner {
-                uint64_t rasult;
+                std::array<uint8_t, 32> seed;
                 uint64_t winner;
+                uint64_t round;
             } winner;
 
-            typedef alaio::multi_index< "games"_n, game, indexed_by< "ending"_n, const_mem_fun<game, uint64_t, &game::get_ends > > > games_index;
+            typedef alaio::multi_index< "games"_n, game, indexed_by< "bystatus"_n, const_mem_fun<game, uint128_t, &game::get_status > > > games_index;
             
-            typedef alaio::multi_index< "tickets"_n, ticket, indexed_by< "byuser"_n, const_mem_fun< ticket, uint64_t, &ticket::get_user > > > tickets_index;
+            typedef alaio::multi_index< "tickets"_n, ticket > tickets_index;
+
+            typedef alaio::multi_index< "participants"_n, participant > participants_index;
 
-            typedef alaio::multi_index< "referrals"_n, referral, indexed_by< "byreferrals"_n, const_mem_fun< referral,uint64_t, &referral::get_referrals > >,indexed_by< "bytree"_n,const_mem_fun<referral,uint64_t,&referral::get_treepos>>> referrals_index;
+            typedef alaio::multi_index< "commitments"_n, commitment, indexed_by< "bycommit"_n, const_mem_fun< commitment, uint128_t, &commitment::get_commitment > > > commitments_index;
 
-            typedef alaio::multi_index< "referrers"_n, referrers, indexed_by< "byuser"_n, const_mem_fun< referrers,uint64_t, &referrers::get_user > >, indexed_by< "byreferrer"_n, const_mem_fun< referrers,uint64_t, &referrers::get_referrer > > > referrers_index;
+            typedef alaio::multi_index< "referrals"_n, referral, indexed_by< "byreferrals"_n, const_mem_fun< referral,uint64_t, &referral::get_referrals > > > referrals_index;
+
+            typedef alaio::multi_index< "referrers"_n, referrers, indexed_by< "bypair"_n, const_mem_fun< referrers,uint128_t, &referrers::get_pair > > > referrers_index;
 
             typedef alaio::multi_index< "hashes"_n, hash > game_hashes;
 
-            typedef alaio::multi_index< "winpercent"_n, percentages > winner_percentage;
+            typedef alaio::multi_index< "settlements"_n, settlement > settlements_index;
+
+            typedef alaio::multi_index< "winners"_n, game_winner > winners_index;
+
+            typedef alaio::multi_index< "results"_n, result > results_index;
+
+            typedef alaio::multi_index< "swaps"_n, ticket_swap > swaps_index;
+
+            typedef alaio::multi_index< "balances"_n, user_balance > balances_index;
 
             typedef alaio::multi_index< "stat"_n, currency_stats > stats;
 
+            asset tree_owed( const referral& member, const uint128_t& tree_index, const symbol& sym );
+
+            purchase_memo parse_memo( std::string_view memo );
+
+            void buy_tickets( games_index& games, const name& user, const asset& quantity, const name& game, const purchase_memo& parsed );
+
+            uint8_t parse_hex_digit( const char& c );
+
+            uint64_t parse_uint64( std::string_view digits );
+
+            checksum256 parse_hash_hex( std::string_view digits );
+
+            checksum256 parse_hash_base58( std::string_view digits );
+
     };
 }
\ No newline at end of file